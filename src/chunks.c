@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include "chunks.h"
+#include "trace.h"
 
 //  Updates maps chunks array with given chunk
 static void MapChunk(map* ptrMap, chunk* ptrChn) {
@@ -19,15 +20,13 @@ static void MapChunk(map* ptrMap, chunk* ptrChn) {
     }
 }
 
-static chunklist* AddToList(chunklist* last, chunk* addition) {
-    chunklist* newnode = (chunklist*)malloc(sizeof(chunklist));
-    newnode->chn = addition;
-    if (last == NULL) {
-        newnode->prev = NULL;
-    } else {
-        newnode->prev = last;
-    }
-    return newnode;
+//  Default allocator of maps
+static void* DefaultAlloc(size_t size, void* user) {
+    return malloc(size);
+}
+
+static void DefaultFree(void* ptr, void* user) {
+    free(ptr);
 }
 
 static void InterpolateCenter(map* ptr, chunk* chn) {
@@ -42,29 +41,86 @@ static void InterpolateCenter(map* ptr, chunk* chn) {
     chn->im = ptr->im_low + imstep*chunky;
 }
 
-static chunk* CreateChunk(map* ptr, unsigned x, unsigned y, unsigned w, unsigned h) {
-    chunk* add = (chunk*)malloc(sizeof(chunk));
-    if (add) {
-        add->iterations = 0;
-        add->x = x;
-        add->y = y;
-        add->w = w;
-        add->h = h;
-        add->rl = 0;
-        add->im = 0;
-        add->flags |= CHUNK_CALC;
-
-        InterpolateCenter(ptr, add);
-        MapChunk(ptr, add);
-        ptr->lastChunk = AddToList(ptr->lastChunk, add);
+//  Allocates chunk and its list node, both or neither
+static chunk* AllocChunk(map* ptr, chunklist** node) {
+    chunk* add = (chunk*)ptr->alloc.alloc(sizeof(chunk), ptr->alloc.user);
+    *node = add ? (chunklist*)ptr->alloc.alloc(sizeof(chunklist), ptr->alloc.user) : NULL;
+    if (add && !*node) {
+        //  Without list node the chunk could never be freed
+        ptr->alloc.free(add, ptr->alloc.user);
+        add = NULL;
     }
     return add;
 }
 
+//  Sets area of allocated chunk, maps it and adds it to the list
+static void PlaceChunk(map* ptr, chunk* add, chunklist* node, unsigned x, unsigned y, unsigned w, unsigned h) {
+    add->iterations = 0;
+    add->x = x;
+    add->y = y;
+    add->w = w;
+    add->h = h;
+    add->rl = 0;
+    add->im = 0;
+    add->flags = CHUNK_CALC;
+
+    InterpolateCenter(ptr, add);
+    MapChunk(ptr, add);
+    node->chn = add;
+    node->prev = ptr->lastChunk;
+    ptr->lastChunk = node;
+
+    TRACE_COUNT(TRACE_CHUNKS_CREATED, 1);
+    TRACE_COUNT(TRACE_BYTES_ALLOCATED, sizeof(chunk) + sizeof(chunklist));
+}
+
+static chunk* CreateChunk(map* ptr, unsigned x, unsigned y, unsigned w, unsigned h) {
+    chunklist* node;
+    chunk* add = AllocChunk(ptr, &node);
+    if (add) PlaceChunk(ptr, add, node, x, y, w, h);
+    return add;
+}
+
+//  Returns iterations until point escapes, spent and earlyOuts are increased
+static unsigned Escape(double crl, double cim, unsigned max_iter, unsigned long long* spent, unsigned long long* earlyOuts) {
+    unsigned iterations = 0;
+    unsigned long long count = 0;
+    double im = 0, rl = 0, sum = 0, lastSum = 0;
+    do {
+        double tmp = rl*rl -im*im +crl;
+        im = 2*rl*im +cim;
+        rl = tmp;
+        count++;
+
+        lastSum = sum;
+        sum = rl*rl + im*im;
+        if (lastSum == sum) {
+            iterations = max_iter;
+            (*earlyOuts)++;
+            break;
+        }
+    } while (sum < 4 && iterations++ < max_iter);
+    *spent += count;
+    return iterations;
+}
+
 // -------------------------------------------------------------
 //  Functions declared in chunks.h
 map* InitMap(unsigned mapw, unsigned maph, unsigned base, double rl_low, double rl_high, double im_low, double im_high) {
-    map* ret = (map*)malloc(sizeof(map));
+    return InitMapWith(NULL, mapw, maph, base, rl_low, rl_high, im_low, im_high);
+}
+
+map* InitMapWith(const chunkalloc* alloc, unsigned mapw, unsigned maph, unsigned base, double rl_low, double rl_high, double im_low, double im_high) {
+    return InitMapAt(alloc, mapw, maph, base, 0, 0, rl_low, rl_high, im_low, im_high);
+}
+
+map* InitMapAt(const chunkalloc* alloc, unsigned mapw, unsigned maph, unsigned base, unsigned ox, unsigned oy, double rl_low, double rl_high, double im_low, double im_high) {
+    chunkalloc use = {DefaultAlloc, DefaultFree, NULL};
+    if (alloc) use = *alloc;
+
+    map* ret = (map*)use.alloc(sizeof(map), use.user);
+    if (!ret) return NULL;
+    ret->alloc = use;
     ret->width = mapw;
     ret->height = maph;
     ret->chunks = NULL;
@@ -76,33 +132,23 @@ map* InitMap(unsigned mapw, unsigned maph, unsigned base, double rl_low, double
 
     //  Every cell/pixel belongs to chunk
     unsigned len = mapw*maph;
-    ret->chunks = (chunk**)malloc(sizeof(chunk*)*len);
-
-    //  Chunks per row/column
-    int chunksX = mapw/base;
-    int chunksY = maph/base;
-    if (mapw%base > 0) chunksX++;
-    if (maph%base > 0) chunksY++;
-
-    for (unsigned row = 0; row < chunksY; row++) {
-        unsigned chnH = base;
-        unsigned chnW = base;
-
-        //  If chunk is too tall make it shorter
-        if (base*row+chnH > maph) {
-            chnH -= base*row+chnH-maph;
-            if (chnH <= 0) break;   // heigh must be atleast 1
-        }
-
-        for (unsigned col = 0; col < chunksX; col++) {
-            //  If chunk is too wide make it narrow
-            if (base*col+chnW > mapw) {
-                chnW -= base*col+chnW-mapw;
-                if (chnW <= 0) break;
-            }
-            //  Create chunk
-            CreateChunk(ret, col*base, row*base, chnW, chnH);
+    ret->chunks = (chunk**)use.alloc(sizeof(chunk*)*len, use.user);
+    if (!ret->chunks) return FreeMap(ret);
+    TRACE_COUNT(TRACE_BYTES_ALLOCATED, sizeof(map) + sizeof(chunk*)*len);
+
+    //  Chunks start from multiples of base counted from the start of the grid, so first and last ones may be smaller
+    for (unsigned y = 0; y < maph;) {
+        unsigned chnH = base - (y+oy)%base;
+        if (y+chnH > maph) chnH = maph-y;
+
+        for (unsigned x = 0; x < mapw;) {
+            unsigned chnW = base - (x+ox)%base;
+            if (x+chnW > mapw) chnW = mapw-x;
+            //  Create chunk, every cell must belong to one
+            if (!CreateChunk(ret, x, y, chnW, chnH)) return FreeMap(ret);
+            x += chnW;
         }
+        y += chnH;
     }
     return ret;
 }
@@ -112,17 +158,17 @@ map* FreeMap(map* ptr) {
     //  Iterate through chunklist and free the chunk and the list element
     chunklist* last = ptr->lastChunk;
     while (last != NULL) {
-        free(last->chn);
+        ptr->alloc.free(last->chn, ptr->alloc.user);
         chunklist* tmp = last;
         last = last->prev;
-        free(tmp);
+        ptr->alloc.free(tmp, ptr->alloc.user);
     }
     ptr->lastChunk = NULL;
 
     //  Free chunks array
-    free(ptr->chunks);
+    if (ptr->chunks) ptr->alloc.free(ptr->chunks, ptr->alloc.user);
     ptr->chunks = NULL;
-    free(ptr);
+    ptr->alloc.free(ptr, ptr->alloc.user);
     return NULL;
 }
 
@@ -202,21 +248,38 @@ int SplitChunks(map* ptr) {
             if (chn->w > 1) split |=1;
             if (chn->h > 1) split |=2;
 
+            if (split == 0) {  // 1x1 chunk, cannot split
+                cur = cur->prev;
+                continue;
+            }
+
+            //  Allocate new chunks before changing this one, so a failure leaves the map intact
+            chunk* add[3];
+            chunklist* node[3];
+            unsigned needed = (split == 3) ? 3 : 1;
+            for (unsigned i = 0; i < needed; i++) {
+                add[i] = AllocChunk(ptr, &node[i]);
+                if (!add[i]) {
+                    while (i-- > 0) {
+                        ptr->alloc.free(add[i], ptr->alloc.user);
+                        ptr->alloc.free(node[i], ptr->alloc.user);
+                    }
+                    chn->flags |= CHUNK_DIFF;
+                    return -1;
+                }
+            }
+
             switch (split) {
-                case 0: {  // 1x1 chunk, cannot split
-                    cur = cur->prev;
-                    continue;
-                } break;
                 case 1: {   //  Vertical split
                     chn->w /= 2;
                     w -= chn->w;
-                    CreateChunk(ptr, chn->x+chn->w, chn->y, w, chn->h); // right
+                    PlaceChunk(ptr, add[0], node[0], chn->x+chn->w, chn->y, w, chn->h); // right
                     count += 2;
                 } break;
                 case 2: {   //  Horizontal
                     chn->h /= 2;
                     h -= chn->h;
-                    CreateChunk(ptr, chn->x, chn->y+chn->h, chn->w, h); // bottom
+                    PlaceChunk(ptr, add[0], node[0], chn->x, chn->y+chn->h, chn->w, h); // bottom
                     count += 2;
                 } break;
                 case 3: {
@@ -225,9 +288,9 @@ int SplitChunks(map* ptr) {
                     w -= chn->w;
                     h -= chn->h;
 
-                    CreateChunk(ptr, chn->x+chn->w, chn->y, w, chn->h); // right-top
-                    CreateChunk(ptr, chn->x, chn->y+chn->h, chn->w, h); // bottom-left
-                    CreateChunk(ptr, chn->x+chn->w, chn->y+chn->h, w, h); // bottom-right
+                    PlaceChunk(ptr, add[0], node[0], chn->x+chn->w, chn->y, w, chn->h); // right-top
+                    PlaceChunk(ptr, add[1], node[1], chn->x, chn->y+chn->h, chn->w, h); // bottom-left
+                    PlaceChunk(ptr, add[2], node[2], chn->x+chn->w, chn->y+chn->h, w, h); // bottom-right
                     count += 4;
                 }
             }
@@ -239,29 +302,40 @@ int SplitChunks(map* ptr) {
     return count;
 }
 
-void IterateChunks(map* src, unsigned max_iter) {
+unsigned IterateChunks(map* src, unsigned max_iter) {
     chunklist* cur = src->lastChunk;
+    //  Collected locally so tracing costs nothing inside the loop
+    unsigned long long iterated = 0, spent = 0, earlyOuts = 0;
 
     //  find chunks with CHUNK_CALC flag set
     while (cur != NULL) {
         chunk* chn = cur->chn;
         if (chn->flags & CHUNK_CALC) {
             chn->flags &= ~CHUNK_CALC;  // unset flag
-            chn->iterations = 0;
-            double im = 0, rl = 0, sum = 0, lastSum = 0;
-            do {
-                double tmp = rl*rl -im*im +chn->rl;
-                im = 2*rl*im +chn->im;
-                rl = tmp;
-
-                lastSum = sum;
-                sum = rl*rl + im*im;
-                if (lastSum == sum) {
-                    chn->iterations = max_iter;
-                    break;
-                }
-            } while (sum < 4 && chn->iterations++ < max_iter);
+            chn->iterations = Escape(chn->rl, chn->im, max_iter, &spent, &earlyOuts);
+            iterated++;
         }
         cur = cur->prev;
     }
+    TRACE_COUNT(TRACE_CHUNKS_ITERATED, iterated);
+    TRACE_COUNT(TRACE_ITERATIONS, spent);
+    TRACE_COUNT(TRACE_EARLY_OUTS, earlyOuts);
+    return iterated;
+}
+
+void SupersampleChunk(map* ptr, chunk* chn, unsigned max_iter, unsigned grid, unsigned* out) {
+    double rlstep = (ptr->rl_high - ptr->rl_low) /ptr->width;
+    double imstep = (ptr->im_high - ptr->im_low) /ptr->height;
+    unsigned long long spent = 0, earlyOuts = 0;
+
+    //  Samples are in the middle of grid cells covering the whole chunk
+    for (unsigned row = 0; row < grid; row++) {
+        double im = ptr->im_low + imstep*(ptr->height - chn->y - chn->h*(row+0.5)/grid);
+        for (unsigned col = 0; col < grid; col++) {
+            double rl = ptr->rl_low + rlstep*(chn->x + chn->w*(col+0.5)/grid);
+            *out++ = Escape(rl, im, max_iter, &spent, &earlyOuts);
+        }
+    }
+    TRACE_COUNT(TRACE_ITERATIONS, spent);
+    TRACE_COUNT(TRACE_EARLY_OUTS, earlyOuts);
 }
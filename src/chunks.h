@@ -1,3 +1,5 @@
+#include <stddef.h>
+
 #define CHUNK_DIFF 1
 #define CHUNK_CALC 2
 
@@ -13,20 +15,35 @@ typedef struct chunklist {
     struct chunklist* prev;
 } chunklist;
 
+//  Memory functions used by map, user is passed to every call
+typedef struct chunkalloc {
+    void* (*alloc)(size_t size, void* user);
+    void (*free)(void* ptr, void* user);
+    void* user;
+} chunkalloc;
+
 typedef struct map {
     chunk** chunks; //  Array of pointers to chunks. Cell for every pixel
     chunklist* lastChunk;
     double rl_low, rl_high, im_low, im_high;
     unsigned int width, height;
+    chunkalloc alloc;
 } map;
 
 //  Initializes map to chunks with given size
 extern map* InitMap(unsigned int mapw, unsigned int maph, unsigned int base, double rll, double rlr, double imb, double imt);
+//  Same as InitMap, memory is allocated with alloc or malloc if NULL. Returns NULL if allocation fails
+extern map* InitMapWith(const chunkalloc* alloc, unsigned int mapw, unsigned int maph, unsigned int base, double rll, double rlr, double imb, double imt);
+//  Same as InitMapWith, but chunk grid starts ox, oy pixels left and up from the map, so the map has the same chunks as
+//  that part of a larger map
+extern map* InitMapAt(const chunkalloc* alloc, unsigned int mapw, unsigned int maph, unsigned int base, unsigned int ox, unsigned int oy, double rll, double rlr, double imb, double imt);
 //  Frees memory allocated for map, map will be freed as well, return NULL
 extern map* FreeMap(map* src);
 //  Sets CHUNK_DIFF if difference of iterations to its neighbors is > maxdiff
 extern void FlagDifferent(map* ptr, unsigned int maxdiff);
-//  Splits flagged chunks if possible, and sets CHUNK_CALC
+//  Splits flagged chunks if possible, and sets CHUNK_CALC. Returns number of chunks split into, -1 if allocation fails
 extern int SplitChunks(map* ptr);
-//  Calculates mandelbrot for given array of chunks
-extern void IterateChunks(map* src, unsigned int max_iter);
+//  Calculates mandelbrot for chunks with CHUNK_CALC, returns number of chunks calculated
+extern unsigned int IterateChunks(map* src, unsigned int max_iter);
+//  Calculates grid*grid evenly spread samples inside chunk to out, used for anti-aliasing
+extern void SupersampleChunk(map* ptr, chunk* chn, unsigned int max_iter, unsigned int grid, unsigned int* out);
@@ -0,0 +1,563 @@
+#include "tiles.h"
+#include "trace.h"
+#include <arpa/inet.h> /* htonl, ntohl */
+#include <endian.h>     /* htobe64, be64toh */
+#include <errno.h>
+#include <netdb.h>      /* getaddrinfo */
+#include <netinet/in.h>
+#include <netinet/tcp.h>  /* TCP_KEEPIDLE */
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>      /* fprintf, printf */
+#include <stdlib.h>     /* malloc, free, atoi */
+#include <string.h>     /* parsing cmdline args */
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEF_WIDTH  1200
+#define DEF_HEIGHT 720
+#define DEF_PORT   "7878"
+#define DEF_TILE   256
+#define MAX_WORKERS 256
+#define DEF_TIMEOUT 600     //  seconds a worker may spend on one tile
+#define IO_TIMEOUT  5       //  seconds a read or write of a started message may stall
+
+//  Message types
+#define MSG_READY  1    //  worker -> coordinator, asks for a tile
+#define MSG_TILE   2    //  coordinator -> worker, tile to render
+#define MSG_RESULT 3    //  worker -> coordinator, followed by w*h colors as 0xRRGGBB
+#define MSG_QUIT   4    //  coordinator -> worker, no more tiles
+
+//  Every message is the same size, words are sent in big endian
+enum { W_TYPE, W_ID, W_X, W_Y, W_W, W_H, W_WIDTH, W_HEIGHT, W_BASE, W_ITER, W_DIFF, W_AA, W_RL_LOW, W_RL_HIGH, W_IM_LOW, W_IM_HIGH, MSG_WORDS };
+typedef struct message {
+    uint64_t word[MSG_WORDS];
+} message;
+
+//  Connected worker
+typedef struct worker {
+    int fd;
+    int tile;   //  index of tile being rendered, -1 if none
+    int ready;  //  waiting for a tile
+    time_t started; //  when the tile was given
+} worker;
+
+#define TILE_PENDING  0
+#define TILE_RENDERING 1
+#define TILE_DONE     2
+
+static int ReadFull(int fd, void* buf, size_t len);
+static int WriteFull(int fd, const void* buf, size_t len);
+static int SendMessage(int fd, const message* msg);
+static int RecvMessage(int fd, message* msg);
+static uint64_t PackDouble(double d);
+static double UnpackDouble(uint64_t w);
+
+//  Listens port and hands tiles to connected workers until every tile is done
+static int Coordinate(const tileview* view, unsigned tilesize, const char* port, unsigned spawn, unsigned timeout, const char* trace, unsigned* image);
+//  Reaps local workers which have exited, returns number still running
+static unsigned CheckWorkers(pid_t* pids, unsigned n);
+//  Waits for local workers to quit, those still running after IO_TIMEOUT seconds are terminated
+static void ReapWorkers(pid_t* pids, unsigned n);
+//  Connects to coordinator and renders tiles until told to quit, traces to files starting with trace if given
+static int Work(const char* host, const char* port, const char* trace);
+//  Writes colors packed as 0xRRGGBB as 24-bit BMP
+static int WriteBMP(const char* name, const unsigned* image, unsigned w, unsigned h);
+
+int main(int argc, char** argv) {
+    tileview view = {
+        .width = DEF_WIDTH,
+        .height = DEF_HEIGHT,
+        .rl_low = -2.0f,
+        .rl_high = 1.0f,
+        .im_low = 1.0f,
+        .im_high = -1.0f,
+        .base = 128,
+        .max_iter = 100,
+        .max_diff = 3
+    };
+    unsigned tilesize = DEF_TILE;
+    unsigned spawn = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned timeout = DEF_TIMEOUT;
+    const char* port = DEF_PORT;
+    const char* output = "farm.bmp";
+    const char* trace = NULL;
+
+    signal(SIGPIPE, SIG_IGN);   //  Broken connections are handled by return values
+
+    //  Process cmd line arguments
+    for (unsigned i=1; i<argc; i++) {
+        if (!strcmp(argv[i], "-width")) {
+            if (++i < argc) view.width = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "-height")) {
+            if (++i < argc) view.height = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "-i")) {
+            if (++i < argc) view.max_iter = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "-b")) {
+            if (++i < argc) view.base = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "-d")) {
+            if (++i < argc) view.max_diff = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "-aa")) {
+            if (++i < argc) view.aa = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "-p")) {
+            if (i+4 < argc) {
+                view.rl_low = atof(argv[++i]);
+                view.rl_high = atof(argv[++i]);
+                view.im_low = atof(argv[++i]);
+                view.im_high = atof(argv[++i]);
+            }
+        } else if (!strcmp(argv[i], "-tile")) {
+            if (++i < argc) tilesize = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "-port")) {
+            if (++i < argc) port = argv[i];
+        } else if (!strcmp(argv[i], "-spawn")) {
+            if (++i < argc) spawn = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "-timeout")) {
+            if (++i < argc) timeout = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "-o")) {
+            if (++i < argc) output = argv[i];
+        } else if (!strcmp(argv[i], "-trace")) {
+            if (++i < argc) trace = argv[i];
+        } else if (!strcmp(argv[i], "-worker")) {
+            if (i+2 < argc) return Work(argv[i+1], argv[i+2], trace);
+        } else {
+            printf ("Usage: ./mandelfarm [options] \
+            \nOptions: \
+            \n -width <width> \t image width\
+            \n -height <height>\t image height\
+            \n -i <iterations>\t maximum iterations\
+            \n -b <base>\t\t initial chunk size\
+            \n -d <difference>\t maximum difference between chunks\
+            \n -aa <grid>\t\t anti-alias edges with grid*grid samples\
+            \n -p <real-low> <real-up> <im-low> <im-up>\tbounds in complex plane\
+            \n -tile <size>\t\t tile size, rounded to multiple of base\
+            \n -port <port>\t\t port to listen for workers\
+            \n -spawn <workers>\t number of local worker processes\
+            \n -timeout <seconds>\t time a worker may spend on a tile before it is given to others\
+            \n -o <file>\t\t output BMP file\
+            \n -trace <prefix>\t workers write <prefix>-<pid>.json and .csv, one row per tile\
+            \n -worker <host> <port>\trun as a worker of coordinator in host\n");
+            return -1;
+        }
+    }
+    if (view.width == 0 || view.height == 0 || view.base == 0) {
+        fprintf(stderr, "ERROR: Image size and base must be positive.\n");
+        return 1;
+    }
+    if (view.aa > MAX_AA) {
+        fprintf(stderr, "ERROR: Anti-aliasing grid must be at most %u.\n", MAX_AA);
+        return 1;
+    }
+
+    unsigned* image = (unsigned*)malloc(sizeof(unsigned)*view.width*view.height);
+    if (!image) {
+        fprintf(stderr, "ERROR: Image allocation failed.\n");
+        return 1;
+    }
+
+    int ret = Coordinate(&view, tilesize, port, spawn, timeout, trace, image);
+    if (ret == 0) {
+        printf("Saving image: %s\n", output);
+        ret = WriteBMP(output, image, view.width, view.height);
+    }
+    free(image);
+    return ret;
+}
+
+static int Coordinate(const tileview* view, unsigned tilesize, const char* port, unsigned spawn, unsigned timeout, const char* trace, unsigned* image) {
+    unsigned count = SplitTiles(view, tilesize, NULL);
+    tile* tiles = (tile*)malloc(sizeof(tile)*count);
+    if (tiles) SplitTiles(view, tilesize, tiles);
+    unsigned char* state = (unsigned char*)calloc(count, 1);
+    unsigned largest = 0;
+    for (unsigned i = 0; tiles && i < count; i++) {
+        if (tiles[i].w*tiles[i].h > largest) largest = tiles[i].w*tiles[i].h;
+    }
+    unsigned* buffer = (unsigned*)malloc(sizeof(unsigned)*largest);
+    pid_t* pids = (pid_t*)calloc(spawn ? spawn : 1, sizeof(pid_t));
+    if (count == 0 || !tiles || !state || !buffer || !pids) {
+        fprintf(stderr, "ERROR: Tile allocation failed.\n");
+        free(tiles);
+        free(state);
+        free(buffer);
+        free(pids);
+        return 1;
+    }
+
+    //  Listen all interfaces so workers in other nodes can connect
+    struct addrinfo hints = {0}, *res = NULL;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int lfd = -1;
+    if (!getaddrinfo(NULL, port, &hints, &res)) {
+        lfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        int on = 1;
+        setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (lfd >= 0 && (bind(lfd, res->ai_addr, res->ai_addrlen) || listen(lfd, 16))) {
+            close(lfd);
+            lfd = -1;
+        }
+        freeaddrinfo(res);
+    }
+    if (lfd < 0) {
+        fprintf(stderr, "ERROR: Cannot listen port %s: %s\n", port, strerror(errno));
+        free(tiles);
+        free(state);
+        free(buffer);
+        free(pids);
+        return 2;
+    }
+
+    //  Local workers connect back through loopback
+    unsigned spawned = 0;
+    for (unsigned i = 0; i < spawn; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(lfd);
+            exit(Work("127.0.0.1", port, trace));
+        } else if (pid < 0) {
+            fprintf(stderr, "ERROR: Cannot spawn worker: %s\n", strerror(errno));
+            break;
+        }
+        pids[spawned++] = pid;
+    }
+    printf("Rendering %u tiles, listening port %s with %u local workers\n", count, port, spawned);
+
+    worker workers[MAX_WORKERS];
+    struct pollfd fds[MAX_WORKERS+1];
+    unsigned nworkers = 0;
+    unsigned done = 0, next = 0;
+
+    while (done < count) {
+        fds[0].fd = lfd;
+        fds[0].events = POLLIN;
+        for (unsigned i = 0; i < nworkers; i++) {
+            fds[i+1].fd = workers[i].fd;
+            fds[i+1].events = POLLIN;
+            fds[i+1].revents = 0;
+        }
+        //  Wake up every second to check tile deadlines
+        unsigned polled = nworkers;
+        int ready = poll(fds, polled+1, 1000);
+        if (ready < 0 && errno != EINTR) break;
+        if (ready < 0) continue;
+        time_t now = time(NULL);
+
+        //  Only workers which were polled have results
+        for (unsigned i = 0; i < polled; i++) {
+            worker* wrk = &workers[i];
+            int ok = 1;
+            if (fds[i+1].revents) {
+                message msg;
+                ok = !RecvMessage(wrk->fd, &msg);
+
+                if (ok && msg.word[W_TYPE] == MSG_RESULT) {
+                    //  Result must match the tile the worker was given
+                    ok = wrk->tile >= 0 && msg.word[W_ID] == (uint64_t)wrk->tile;
+                    tile* t = ok ? &tiles[wrk->tile] : NULL;
+                    if (ok) ok = !ReadFull(wrk->fd, buffer, sizeof(unsigned)*t->w*t->h);
+                    if (ok) {
+                        unsigned length = t->w*t->h;
+                        for (unsigned j = 0; j < length; j++) buffer[j] = ntohl(buffer[j]);
+                        StitchTile(view, t, buffer, image);
+                        state[wrk->tile] = TILE_DONE;
+                        wrk->tile = -1;
+                        wrk->ready = 1;
+                        done++;
+                        printf("\rTiles done: %u/%u", done, count);
+                        fflush(stdout);
+                    }
+                } else if (ok && msg.word[W_TYPE] == MSG_READY) {
+                    wrk->ready = 1;
+                } else {
+                    ok = 0;
+                }
+            } else if (wrk->tile >= 0 && timeout > 0 && now - wrk->started > timeout) {
+                fprintf(stderr, "\nWorker did not finish tile %d in %u seconds, giving it to others\n", wrk->tile, timeout);
+                ok = 0;
+            }
+
+            //  Drop the worker, its tile goes back to the queue
+            if (!ok) {
+                if (wrk->tile >= 0) {
+                    state[wrk->tile] = TILE_PENDING;
+                    if (wrk->tile < next) next = wrk->tile;
+                }
+                close(wrk->fd);
+                wrk->fd = -1;
+            }
+        }
+
+        //  Remove dropped workers
+        unsigned kept = 0;
+        for (unsigned i = 0; i < nworkers; i++) {
+            if (workers[i].fd >= 0) workers[kept++] = workers[i];
+        }
+        nworkers = kept;
+
+        //  Without local workers nobody would take the remaining tiles
+        if (spawned > 0 && nworkers == 0 && CheckWorkers(pids, spawned) == 0) {
+            fprintf(stderr, "\nERROR: Every local worker has exited, %u tiles not rendered.\n", count - done);
+            break;
+        }
+
+        //  New worker. Keepalive and timeouts make sure a silent or vanished peer cannot block the others
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(lfd, NULL, NULL);
+            if (fd >= 0 && nworkers < MAX_WORKERS) {
+                int on = 1, idle = 60, interval = 10, probes = 3;
+                struct timeval tv = { IO_TIMEOUT, 0 };
+                setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+                setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+                setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+                setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+                workers[nworkers].fd = fd;
+                workers[nworkers].tile = -1;
+                workers[nworkers].ready = 0;
+                nworkers++;
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+
+        //  Hand out pending tiles to waiting workers, fast workers simply get more of them
+        for (unsigned i = 0; i < nworkers; i++) {
+            worker* wrk = &workers[i];
+            while (next < count && state[next] != TILE_PENDING) next++;
+            if (next >= count) break;
+            if (!wrk->ready) continue;
+
+            tile* t = &tiles[next];
+            message task = {{0}};
+            task.word[W_TYPE] = MSG_TILE;
+            task.word[W_ID] = next;
+            task.word[W_X] = t->x;
+            task.word[W_Y] = t->y;
+            task.word[W_W] = t->w;
+            task.word[W_H] = t->h;
+            task.word[W_WIDTH] = view->width;
+            task.word[W_HEIGHT] = view->height;
+            task.word[W_BASE] = view->base;
+            task.word[W_ITER] = view->max_iter;
+            task.word[W_DIFF] = view->max_diff;
+            task.word[W_AA] = view->aa;
+            task.word[W_RL_LOW] = PackDouble(view->rl_low);
+            task.word[W_RL_HIGH] = PackDouble(view->rl_high);
+            task.word[W_IM_LOW] = PackDouble(view->im_low);
+            task.word[W_IM_HIGH] = PackDouble(view->im_high);
+
+            //  If sending fails the worker is dropped when poll reports it
+            if (!SendMessage(wrk->fd, &task)) {
+                state[next] = TILE_RENDERING;
+                wrk->tile = next;
+                wrk->ready = 0;
+                wrk->started = now;
+            }
+        }
+    }
+    printf("\n");
+
+    //  Every tile is done, tell workers to quit
+    message quit = {{0}};
+    quit.word[W_TYPE] = MSG_QUIT;
+    for (unsigned i = 0; i < nworkers; i++) {
+        SendMessage(workers[i].fd, &quit);
+        close(workers[i].fd);
+    }
+    close(lfd);
+    //  A stalled worker must not keep the image from being written
+    ReapWorkers(pids, spawned);
+
+    free(tiles);
+    free(state);
+    free(buffer);
+    free(pids);
+    return done < count ? 3 : 0;
+}
+
+static unsigned CheckWorkers(pid_t* pids, unsigned n) {
+    unsigned running = 0;
+    for (unsigned i = 0; i < n; i++) {
+        if (pids[i] <= 0) continue;
+        if (waitpid(pids[i], NULL, WNOHANG) == 0) running++;
+        else pids[i] = 0;
+    }
+    return running;
+}
+
+static void ReapWorkers(pid_t* pids, unsigned n) {
+    time_t deadline = time(NULL) + IO_TIMEOUT;
+    while (CheckWorkers(pids, n) > 0 && time(NULL) < deadline) usleep(10000);
+
+    for (unsigned i = 0; i < n; i++) {
+        if (pids[i] <= 0) continue;
+        fprintf(stderr, "Worker %d did not quit, terminating it\n", (int)pids[i]);
+        //  Stopped process acts on the signal only when continued
+        kill(pids[i], SIGTERM);
+        kill(pids[i], SIGCONT);
+        waitpid(pids[i], NULL, 0);
+        pids[i] = 0;
+    }
+}
+
+static int Work(const char* host, const char* port, const char* trace) {
+    struct addrinfo hints = {0}, *res = NULL;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res)) {
+        fprintf(stderr, "ERROR: Cannot resolve %s:%s\n", host, port);
+        return 1;
+    }
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen)) {
+        fprintf(stderr, "ERROR: Cannot connect %s:%s: %s\n", host, port, strerror(errno));
+        freeaddrinfo(res);
+        if (fd >= 0) close(fd);
+        return 2;
+    }
+    freeaddrinfo(res);
+
+    TraceEnable(trace != NULL);
+
+    message msg = {{0}};
+    msg.word[W_TYPE] = MSG_READY;
+    int err = SendMessage(fd, &msg);
+
+    unsigned* buffer = NULL;
+    unsigned size = 0;
+    while (!err && !RecvMessage(fd, &msg) && msg.word[W_TYPE] == MSG_TILE) {
+        tileview view = {
+            .width = msg.word[W_WIDTH],
+            .height = msg.word[W_HEIGHT],
+            .rl_low = UnpackDouble(msg.word[W_RL_LOW]),
+            .rl_high = UnpackDouble(msg.word[W_RL_HIGH]),
+            .im_low = UnpackDouble(msg.word[W_IM_LOW]),
+            .im_high = UnpackDouble(msg.word[W_IM_HIGH]),
+            .base = msg.word[W_BASE],
+            .max_iter = msg.word[W_ITER],
+            .max_diff = msg.word[W_DIFF],
+            .aa = msg.word[W_AA]
+        };
+        tile t = { msg.word[W_X], msg.word[W_Y], msg.word[W_W], msg.word[W_H] };
+
+        unsigned length = t.w*t.h;
+        if (length > size) {
+            free(buffer);
+            buffer = (unsigned*)malloc(sizeof(unsigned)*length);
+            size = buffer ? length : 0;
+        }
+        if (!buffer || RenderTileRGB(&view, &t, NULL, buffer) < 0) {
+            fprintf(stderr, "ERROR: Worker %d failed to render tile %u.\n", (int)getpid(), (unsigned)msg.word[W_ID]);
+            err = 1;
+            break;
+        }
+        TraceEndPass();
+        for (unsigned i = 0; i < length; i++) buffer[i] = htonl(buffer[i]);
+
+        msg.word[W_TYPE] = MSG_RESULT;
+        err = SendMessage(fd, &msg) || WriteFull(fd, buffer, sizeof(unsigned)*length);
+    }
+
+    free(buffer);
+    close(fd);
+
+    if (trace) {
+        char name[512];
+        snprintf(name, sizeof(name), "%s-%d.json", trace, (int)getpid());
+        TraceWriteJSON(name);
+        snprintf(name, sizeof(name), "%s-%d.csv", trace, (int)getpid());
+        TraceWriteCSV(name);
+    }
+    return err;
+}
+
+static int WriteBMP(const char* name, const unsigned* image, unsigned w, unsigned h) {
+    FILE* file = fopen(name, "wb");
+    if (!file) {
+        fprintf(stderr, "ERROR: Cannot open %s\n", name);
+        return 4;
+    }
+
+    unsigned rowsize = (w*3 + 3) & ~3u;  //  Rows are padded to 4 bytes
+    unsigned datasize = rowsize*h;
+    unsigned char header[54] = {'B', 'M'};
+    unsigned fields[][2] = {    //  offset, value
+        {2, 54+datasize}, {10, 54}, {14, 40}, {18, w}, {22, h}, {34, datasize}
+    };
+    for (unsigned i = 0; i < sizeof(fields)/sizeof(fields[0]); i++) {
+        for (unsigned b = 0; b < 4; b++) header[fields[i][0]+b] = fields[i][1] >> (8*b);
+    }
+    header[26] = 1;     //  planes
+    header[28] = 24;    //  bits per pixel
+    fwrite(header, 1, sizeof(header), file);
+
+    unsigned char* row = (unsigned char*)calloc(rowsize, 1);
+    //  BMP is stored bottom-up
+    for (unsigned y = h; row && y-- > 0;) {
+        const unsigned* src = image + y*w;
+        for (unsigned x = 0; x < w; x++) {
+            unsigned char* bgr = row + x*3;
+            bgr[0] = src[x];
+            bgr[1] = src[x] >> 8;
+            bgr[2] = src[x] >> 16;
+        }
+        fwrite(row, 1, rowsize, file);
+    }
+    free(row);
+    return fclose(file) ? 4 : 0;
+}
+
+static int ReadFull(int fd, void* buf, size_t len) {
+    char* ptr = (char*)buf;
+    while (len > 0) {
+        ssize_t got = read(fd, ptr, len);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return 1;
+        ptr += got;
+        len -= got;
+    }
+    return 0;
+}
+
+static int WriteFull(int fd, const void* buf, size_t len) {
+    const char* ptr = (const char*)buf;
+    while (len > 0) {
+        ssize_t put = write(fd, ptr, len);
+        if (put < 0 && errno == EINTR) continue;
+        if (put <= 0) return 1;
+        ptr += put;
+        len -= put;
+    }
+    return 0;
+}
+
+static int SendMessage(int fd, const message* msg) {
+    message out;
+    for (unsigned i = 0; i < MSG_WORDS; i++) out.word[i] = htobe64(msg->word[i]);
+    return WriteFull(fd, &out, sizeof(out));
+}
+
+static int RecvMessage(int fd, message* msg) {
+    if (ReadFull(fd, msg, sizeof(*msg))) return 1;
+    for (unsigned i = 0; i < MSG_WORDS; i++) msg->word[i] = be64toh(msg->word[i]);
+    return 0;
+}
+
+static uint64_t PackDouble(double d) {
+    uint64_t w;
+    memcpy(&w, &d, sizeof(w));
+    return w;
+}
+
+static double UnpackDouble(uint64_t w) {
+    double d;
+    memcpy(&d, &w, sizeof(d));
+    return d;
+}
@@ -1,5 +1,9 @@
 #include "SDL.h"
 #include "chunks.h"
+#include "tiles.h"
+#include "trace.h"
+#include "tune.h"
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>  /* fprintf, printf */
 #include <stdlib.h> /* malloc, free, atoi*/
@@ -8,6 +12,7 @@
 
 #define DEF_WINDOW_WIDTH  1200
 #define DEF_WINDOW_HEIGHT 720
+#define MAX_TUNE_DEPTH 64
 
 typedef struct bounds {
     double rl_high, rl_low, im_high, im_low;
@@ -18,9 +23,30 @@ bounds* CalcNewView(bounds* current, unsigned winWidth, unsigned winHeight, unsi
 void MoveView(bounds* view, double rl, double im);
 // Writes current view to BMP
 void SaveView(SDL_Renderer* ren, unsigned w, unsigned h);
-
-//  Renders Mandelbrot to sdl texture
-SDL_Texture* TextureMandelbrot(SDL_Renderer* ren, map* ptr, unsigned max_iter);
+//  Writes recorded trace to <prefix>.json and <prefix>.csv and clears it
+void SaveTrace(const char* prefix);
+//  Compares chunk settings to brute force, sets recommended base and max_diff. Returns 0 on success, 1 if none is within
+//  tolerance and the finest setting is set, -1 if tuning failed and base and max_diff are unchanged
+int TuneSettings(bounds* view, unsigned w, unsigned h, unsigned max_iter, double tolerance, bool print, unsigned* base, unsigned* max_diff);
+//  Number of times view is zoomed in by half from the whole fractal
+unsigned ZoomDepth(bounds* view);
+
+//  Autotune runs in background so the view stays usable, current settings are kept until it is done
+typedef struct tunejob {
+    pthread_t thread;
+    bool running;
+    int done;           //  set atomically by the tuning thread
+    bounds view;
+    unsigned w, h, max_iter, depth;
+    double tolerance;
+    unsigned base, max_diff;
+    int result;         //  of TuneSettings
+} tunejob;
+//  Starts tuning view in background, returns false if thread could not be started
+bool StartTuneJob(tunejob* job, bounds* view, unsigned w, unsigned h, unsigned max_iter, double tolerance);
+
+//  Renders Mandelbrot to sdl texture, chunks flagged different are supersampled aa*aa times if aa > 1
+SDL_Texture* TextureMandelbrot(SDL_Renderer* ren, map* ptr, unsigned max_iter, unsigned aa);
 
 //  Prints info of every chunk
 void PrintChunks(map* ptr);
@@ -33,6 +59,11 @@ int main(int argc, char** argv) {
     unsigned max_iter = 100;
     unsigned base = 128;
     unsigned max_diff = 3;
+    unsigned aa = 0;
+    bool tune = false;
+    bool autotune = false;
+    double tolerance = 0.001;
+    const char* tracePrefix = "trace";
 
     //  Default view, shows whole fractal
     bounds viewRoot = {
@@ -56,6 +87,17 @@ int main(int argc, char** argv) {
             if (++i < argc) base = atoi(argv[i]);
         } else if (!strcmp(argv[i], "-d")) {
             if (++i < argc) max_diff = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "-tune")) {
+            tune = true;
+        } else if (!strcmp(argv[i], "-autotune")) {
+            autotune = true;
+        } else if (!strcmp(argv[i], "-tol")) {
+            if (++i < argc) tolerance = atof(argv[i]);
+        } else if (!strcmp(argv[i], "-aa")) {
+            if (++i < argc) aa = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "-trace")) {
+            if (++i < argc) tracePrefix = argv[i];
+            TraceEnable(1);
         } else if (!strcmp(argv[i], "-p")) {
             if (i+4 < argc) {
                 bounds* a = (bounds*)malloc(sizeof(bounds));
@@ -74,10 +116,19 @@ int main(int argc, char** argv) {
             \n -i <iterations>\t maximum iterations\
             \n -b <base>\t\t initial chunk size\
             \n -d <difference>\t maximum difference between chunks\
+            \n -tune\t\t\t compare bases and differences to brute force and exit\
+            \n -autotune\t\t tune base and difference once per zoom depth\
+            \n -tol <fraction>\t fraction of pixels allowed to differ when tuning\
+            \n -aa <grid>\t\t anti-alias edges with grid*grid samples when done\
+            \n -trace <prefix>\t start tracing, written to <prefix>.json and <prefix>.csv\
             \n -p <real-low> <real-up> <im-low> <im-up>\tbounds in complex plane\n");
             return -1;
         }
     }
+    if (aa > MAX_AA) {
+        fprintf(stderr, "ERROR: Anti-aliasing grid must be at most %u.\n", MAX_AA);
+        return 1;
+    }
     if (argc > 1) {
         printf("Starting program with: \
         \n\twindow: %u x %u chunk_base: %u \
@@ -85,6 +136,11 @@ int main(int argc, char** argv) {
         winWidth, winHeight, base, viewCurrent->rl_low, viewCurrent->rl_high, viewCurrent->im_low, viewCurrent->im_high, max_iter);
     }
 
+    if (tune) {
+        int ret = TuneSettings(viewCurrent, winWidth, winHeight, max_iter, tolerance, true, &base, &max_diff);
+        return ret < 0 ? 2 : ret;
+    }
+
     if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
         printf("SDL_Init failed!");
         return 1;
@@ -117,6 +173,14 @@ int main(int argc, char** argv) {
     int recalc = 1;
     bool drawChunks = false;
     bool reset = true;
+    unsigned firstTraced = 0;   //  first traced pass of current render
+
+    //  Tuned settings per zoom depth, valid until window size or iterations change
+    struct { bool valid; unsigned base, max_diff; } tuned[MAX_TUNE_DEPTH] = {{0}};
+    unsigned tunedWidth = 0, tunedHeight = 0, tunedIter = 0;
+    //  Static so an unfinished job can outlive main when exiting
+    static tunejob job;
+    bool tuneFailed = false;    //  not tried again until view changes
     bool noQuit = true;
     while (noQuit) {
         //  ------ EVENT HANDLER --------
@@ -177,6 +241,17 @@ int main(int argc, char** argv) {
                         case SDLK_o: {
                             SaveView(ren, winWidth, winHeight);
                         } break;
+                        case SDLK_t: {
+                            //  Trace is written when tracing is turned off
+                            bool on = !TRACE_ENABLED();
+                            if (!on) {
+                                SaveTrace(tracePrefix);
+                                //  Saving starts passes from 0, summary of current render counts from there
+                                firstTraced = TracePasses();
+                            }
+                            TraceEnable(on);
+                            printf("Tracing: %s\n", on ? "true" : "false");
+                        } break;
                         default: break;
                     }
                 } break; // break SDL_KEYUP
@@ -235,50 +310,104 @@ int main(int argc, char** argv) {
             }
         }
         //  ----------- END EVENT HANDLER -------
+        if (job.running && __atomic_load_n(&job.done, __ATOMIC_ACQUIRE)) {
+            pthread_join(job.thread, NULL);
+            job.running = false;
+            //  Result is dropped if window or iterations changed while tuning
+            if (job.result < 0) {
+                fprintf(stderr, "ERROR: Tuning zoom depth %u failed, keeping current settings.\n", job.depth);
+                tuneFailed = true;
+            } else if (job.w == winWidth && job.h == winHeight && job.max_iter == max_iter) {
+                tuned[job.depth].valid = true;
+                tuned[job.depth].base = job.base;
+                tuned[job.depth].max_diff = job.max_diff;
+                printf("Tuned zoom depth %u: chunk_base: %u max_diff: %u\n", job.depth, job.base, job.max_diff);
+                if (job.depth == ZoomDepth(viewCurrent) && (job.base != base || job.max_diff != max_diff)) reset = true;
+            }
+        }
         if (reset) {
             if (mandelbrot) FreeMap(mandelbrot);
 
+            if (autotune) {
+                tuneFailed = false;
+                if (tunedWidth != winWidth || tunedHeight != winHeight || tunedIter != max_iter) {
+                    for (unsigned i = 0; i < MAX_TUNE_DEPTH; i++) tuned[i].valid = false;
+                    tunedWidth = winWidth;
+                    tunedHeight = winHeight;
+                    tunedIter = max_iter;
+                }
+                unsigned depth = ZoomDepth(viewCurrent);
+                if (tuned[depth].valid) {
+                    base = tuned[depth].base;
+                    max_diff = tuned[depth].max_diff;
+                }
+                printf("Using chunk_base: %u max_diff: %u\n", base, max_diff);
+            }
+
             mandelbrot = InitMap(winWidth, winHeight, base, viewCurrent->rl_low, viewCurrent->rl_high, viewCurrent->im_low, viewCurrent->im_high);
             recalc = 1;
+            if (!mandelbrot) {
+                fprintf(stderr, "ERROR: Map allocation failed.\n");
+                recalc = 0;
+                reset = false;
+            }
         }
         //  If recalc is requested
         if (recalc) {
-            static unsigned stats[5] = {0};
+            static unsigned passes = 0;
+            static unsigned started = 0;
             if (reset) {
-                stats[0] = stats[1] = stats[2] = stats[3] = stats[4] = 0;
+                passes = 0;
+                started = SDL_GetTicks();
+                firstTraced = TracePasses();
                 reset = false;
             }
-            stats[0]++;
+            passes++;
 
-            unsigned part = SDL_GetTicks();
-            recalc = SplitChunks(mandelbrot);
-            stats[1] += SDL_GetTicks() - part;
+            //  Nothing is flagged before the first pass, so it always continues
+            TRACE_BEGIN(traceSplit);
+            int split = SplitChunks(mandelbrot);
+            TRACE_END(traceSplit, "Split");
+            if (split < 0) fprintf(stderr, "ERROR: Chunk allocation failed, stopping at current chunks.\n");
+            recalc = split > 0 || (split == 0 && passes == 1);
 
-            part = SDL_GetTicks();
+            TRACE_BEGIN(traceMandel);
             IterateChunks(mandelbrot, max_iter);
-            stats[2] += SDL_GetTicks() - part;
+            TRACE_END(traceMandel, "Mandel");
 
-            part = SDL_GetTicks();
+            TRACE_BEGIN(traceDiff);
             FlagDifferent(mandelbrot, max_diff);
-            stats[3] += SDL_GetTicks() - part;
+            TRACE_END(traceDiff, "Diff");
 
-            part = SDL_GetTicks();
+            TRACE_BEGIN(traceRender);
             if (textMandel) SDL_DestroyTexture(textMandel);
-            textMandel = TextureMandelbrot(ren, mandelbrot, max_iter);
-            stats[4] += SDL_GetTicks() - part;
+            textMandel = TextureMandelbrot(ren, mandelbrot, max_iter, 0);
+            TRACE_END(traceRender, "Render");
+            TraceEndPass();
 
             //  if we are done print some statistics
             if (!recalc) {
-                unsigned total = stats[1] + stats[2] + stats[3] + stats[4];
-                printf("%d times recalc\
-                \nSplit\t%d (%f)\
-                \nMandel\t%d (%f)\
-                \nDiff\t%d (%f)\
-                \nRender\t%d (%f)\
-                \nTotal\t%d (%f)\n", stats[0], stats[1], (float)stats[1]/stats[0], stats[2], (float)stats[2]/stats[0], stats[3], (float)stats[3]/stats[0], stats[4], (float)stats[4]/stats[0], total, (float)total/stats[0]);
-
-                //  Set all stats to 0
-                stats[0] = stats[1] = stats[2] = stats[3] = stats[4] = 0;
+                //  Chunks still flagged are edges which could not be split anymore
+                if (aa > 1) {
+                    TRACE_BEGIN(traceAntialias);
+                    SDL_DestroyTexture(textMandel);
+                    textMandel = TextureMandelbrot(ren, mandelbrot, max_iter, aa);
+                    TRACE_END(traceAntialias, "Antialias");
+                }
+                printf("%u times recalc in %u ms\n", passes, SDL_GetTicks() - started);
+                TracePrintSummary(firstTraced);
+            }
+        }
+
+        //  One depth is tuned at a time, the current one next if it is not tuned yet
+        if (autotune && !job.running && !tuneFailed) {
+            unsigned depth = ZoomDepth(viewCurrent);
+            if (!tuned[depth].valid) {
+                printf("Tuning zoom depth %u\n", depth);
+                if (!StartTuneJob(&job, viewCurrent, winWidth, winHeight, max_iter, tolerance)) {
+                    fprintf(stderr, "ERROR: Tuning thread could not be started, keeping current settings.\n");
+                    tuneFailed = true;
+                }
             }
         }
 
@@ -294,7 +423,7 @@ int main(int argc, char** argv) {
         //  If mandelbrot texture exists
         if (textMandel) SDL_RenderCopy(ren, textMandel, NULL, NULL);
 
-        if (drawChunks) RenderChunksStart(ren, mandelbrot->lastChunk);
+        if (drawChunks && mandelbrot) RenderChunksStart(ren, mandelbrot->lastChunk);
 
         //  If first corner of selection is set, draw box to current mouse location.
         if (selection) {
@@ -321,8 +450,11 @@ int main(int argc, char** argv) {
         free(tmp);
     }
 
+    //  Unfinished tuning is not waited for, it ends with the process
+    if (job.running) pthread_detach(job.thread);
     FreeMap(mandelbrot);
     free(selection);
+    if (TRACE_ENABLED()) SaveTrace(tracePrefix);
 
     SDL_DestroyTexture(textMandel);
     SDL_DestroyRenderer(ren);
@@ -332,29 +464,28 @@ int main(int argc, char** argv) {
     return 0;
 }
 
-SDL_Texture* TextureMandelbrot(SDL_Renderer* ren, map* ptr, unsigned max_iter) {
+//  Red is always full and texture is blended over black, so alpha carries red and green and blue are scaled by it
+static void PutPixel(unsigned char* px, const unsigned rgb[3]) {
+    px[0] = rgb[0];
+    px[1] = rgb[0] ? rgb[2]*255/rgb[0] : 0;
+    px[2] = rgb[0] ? rgb[1]*255/rgb[0] : 0;
+    px[3] = 0xff;
+}
+
+SDL_Texture* TextureMandelbrot(SDL_Renderer* ren, map* ptr, unsigned max_iter, unsigned aa) {
     unsigned length = ptr->width*ptr->height;
     unsigned* pixels = (unsigned*)malloc(sizeof(unsigned)*length);
     if (!pixels) return NULL;
-    for (unsigned i = 0; i < length; i++) pixels[i] = 0;
-
-    double colStep = (double)255/max_iter;
-
-    unsigned char* red = (unsigned char*)pixels;
-    for (int i=0; i < length; i++, red += 4) {
-        *(red+3) = 0xff;
-        unsigned iter = ptr->chunks[i]->iterations;
-        if (iter>= max_iter) {
-            continue;
-        } else if (iter < max_iter/2) {
-            *red = (double)iter * colStep * 2;
-        } else {
-            int c = (double)iter * colStep;
-            *red = 0xff;
-            *(red+1) = c;
-            *(red+2) = c;
-        }
+    unsigned* samples = NULL;
+    if (aa > 1) samples = (unsigned*)malloc(sizeof(unsigned)*aa*aa);
+
+    unsigned char* px = (unsigned char*)pixels;
+    for (int i=0; i < length; i++, px += 4) {
+        unsigned rgb[3];
+        ShadeChunk(ptr, ptr->chunks[i], max_iter, samples ? aa : 0, samples, rgb);
+        PutPixel(px, rgb);
     }
+    free(samples);
 
     SDL_Surface* surf = SDL_CreateRGBSurfaceFrom((void*)pixels, ptr->width, ptr->height, sizeof(unsigned)*8, ptr->width*sizeof(unsigned), 0xff000000, 0x00ff0000, 0x0000ff00, 0x000000ff);
     if (!surf) {
@@ -382,6 +513,7 @@ void RenderChunksStart(SDL_Renderer* ren, chunklist* last) {
 }
 
 void PrintChunks(map* ptr) {
+   if (ptr == NULL) return;
    chunklist* cur = ptr->lastChunk;
    unsigned i = 0;
    unsigned totalArea = 0;
@@ -453,3 +585,88 @@ void SaveView(SDL_Renderer* ren, unsigned w, unsigned h) {
 
     SDL_FreeSurface(screen);
 }
+
+void SaveTrace(const char* prefix) {
+    char name[512];
+    snprintf(name, sizeof(name), "%s.json", prefix);
+    printf("Saving trace: %s\n", name);
+    if (TraceWriteJSON(name)) fprintf(stderr, "Error writing %s.\n", name);
+
+    snprintf(name, sizeof(name), "%s.csv", prefix);
+    printf("Saving trace: %s\n", name);
+    if (TraceWriteCSV(name)) fprintf(stderr, "Error writing %s.\n", name);
+
+    TraceReset();
+}
+
+int TuneSettings(bounds* view, unsigned w, unsigned h, unsigned max_iter, double tolerance, bool print, unsigned* base, unsigned* max_diff) {
+    static const unsigned bases[] = {4, 8, 16, 32, 64, 128};
+    static const unsigned diffs[] = {0, 1, 2, 3, 5, 8, 13};
+    tileview tv = {
+        .width = w,
+        .height = h,
+        .rl_low = view->rl_low,
+        .rl_high = view->rl_high,
+        .im_low = view->im_low,
+        .im_high = view->im_high,
+        .max_iter = max_iter
+    };
+
+    //  Printed table is complete, otherwise settings too wrong to be recommended are not finished
+    tuneresult* results = NULL;
+    unsigned count = TuneView(&tv, bases, sizeof(bases)/sizeof(bases[0]), diffs, sizeof(diffs)/sizeof(diffs[0]),
+        print ? 0 : tolerance, &results);
+    if (count == 0) {
+        fprintf(stderr, "ERROR: Tuning failed, could not allocate renders.\n");
+        return -1;
+    }
+    if (print) TunePrint(results, count, w, h);
+
+    int best = TuneRecommend(results, count, w*h, tolerance);
+    if (best >= 0) {
+        *base = results[best].base;
+        *max_diff = results[best].max_diff;
+        if (print) printf("Recommended: -b %u -d %u\n", *base, *max_diff);
+    } else {
+        //  Nothing is accurate enough, fall back to the finest setting
+        *base = bases[0];
+        *max_diff = diffs[0];
+        if (print) printf("No setting within tolerance %g\n", tolerance);
+    }
+    free(results);
+    return best >= 0 ? 0 : 1;
+}
+
+static void* TuneThread(void* arg) {
+    tunejob* job = (tunejob*)arg;
+    //  Tuning is not part of the traced passes of the view
+    TraceMute(1);
+    job->result = TuneSettings(&job->view, job->w, job->h, job->max_iter, job->tolerance, false, &job->base, &job->max_diff);
+    __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+bool StartTuneJob(tunejob* job, bounds* view, unsigned w, unsigned h, unsigned max_iter, double tolerance) {
+    //  View is copied, the history it links to may be freed while tuning
+    job->view = *view;
+    job->view.last = NULL;
+    job->w = w;
+    job->h = h;
+    job->max_iter = max_iter;
+    job->depth = ZoomDepth(view);
+    job->tolerance = tolerance;
+    job->done = 0;
+    job->running = pthread_create(&job->thread, NULL, TuneThread, job) == 0;
+    return job->running;
+}
+
+unsigned ZoomDepth(bounds* view) {
+    double width = view->rl_high - view->rl_low;
+    if (width < 0) width = -width;
+    unsigned depth = 0;
+    while (width > 0 && width < 3.0 && depth+1 < MAX_TUNE_DEPTH) {
+        width *= 2;
+        depth++;
+    }
+    return depth;
+}
@@ -0,0 +1,203 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "chunks.h"
+#include "tiles.h"
+#include "mandelchunks.h"
+
+struct renderctx {
+    renderopts opts;
+    chunkalloc alloc;
+
+    pthread_t* threads;         //  Helpers of the thread calling RenderView
+    unsigned threadCount;
+    unsigned* buffer;           //  Tile buffer of the thread calling RenderView
+    unsigned size;
+    pthread_mutex_t render;     //  Held for the whole RenderView
+    pthread_mutex_t lock;       //  Protects the job below
+    pthread_cond_t work, finished;
+    int quit;
+
+    //  Current job, threads take tiles in order until all are taken
+    tileview view;
+    tile* tiles;
+    unsigned count, next, done;
+    unsigned* out;
+    int failed;
+};
+
+static void* DefaultAlloc(size_t size, void* user) {
+    return malloc(size);
+}
+
+static void DefaultFree(void* ptr, void* user) {
+    free(ptr);
+}
+
+//  Renders tiles of current job until all are taken. Called with lock held, returns with it held
+static void TakeTiles(renderctx* ctx, unsigned** buffer, unsigned* size) {
+    while (ctx->next < ctx->count) {
+        tile* t = &ctx->tiles[ctx->next++];
+        pthread_mutex_unlock(&ctx->lock);
+
+        //  Tiles are disjoint parts of out, so they are rendered and copied without the lock
+        int err = 0;
+        if (t->w*t->h > *size) {
+            if (*buffer) ctx->alloc.free(*buffer, ctx->alloc.user);
+            *buffer = (unsigned*)ctx->alloc.alloc(sizeof(unsigned)*t->w*t->h, ctx->alloc.user);
+            *size = *buffer ? t->w*t->h : 0;
+        }
+        if (!*buffer || RenderTile(&ctx->view, t, &ctx->alloc, *buffer) < 0) {
+            err = 1;
+        } else {
+            StitchTile(&ctx->view, t, *buffer, ctx->out);
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        if (err) ctx->failed = 1;
+        if (++ctx->done == ctx->count) pthread_cond_signal(&ctx->finished);
+    }
+}
+
+static void* RenderThread(void* arg) {
+    renderctx* ctx = (renderctx*)arg;
+    unsigned* buffer = NULL;
+    unsigned size = 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    while (1) {
+        while (!ctx->quit && ctx->next >= ctx->count) pthread_cond_wait(&ctx->work, &ctx->lock);
+        if (ctx->quit) break;
+        TakeTiles(ctx, &buffer, &size);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (buffer) ctx->alloc.free(buffer, ctx->alloc.user);
+    return NULL;
+}
+
+// -------------------------------------------------------------
+//  Functions declared in mandelchunks.h
+void DefaultRenderOptions(renderopts* opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->threads = 1;
+    opts->tile = 256;
+    opts->base = 128;
+    opts->max_iter = 100;
+    opts->max_diff = 3;
+}
+
+renderctx* CreateRenderContext(const renderopts* opts) {
+    renderopts defaults;
+    if (opts == NULL) {
+        DefaultRenderOptions(&defaults);
+        opts = &defaults;
+    }
+    if (opts->base == 0) return NULL;
+
+    chunkalloc alloc = {DefaultAlloc, DefaultFree, NULL};
+    if (opts->alloc && opts->free) {
+        alloc.alloc = opts->alloc;
+        alloc.free = opts->free;
+        alloc.user = opts->user;
+    }
+
+    renderctx* ctx = (renderctx*)alloc.alloc(sizeof(renderctx), alloc.user);
+    if (!ctx) return NULL;
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->opts = *opts;
+    ctx->alloc = alloc;
+
+    unsigned threads = opts->threads;
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? cpus : 1;
+    }
+
+    //  Calling thread renders too, so one thread needs no helpers
+    if (threads > 1) {
+        ctx->threads = (pthread_t*)alloc.alloc(sizeof(pthread_t)*(threads-1), alloc.user);
+        if (!ctx->threads) {
+            alloc.free(ctx, alloc.user);
+            return NULL;
+        }
+    }
+    pthread_mutex_init(&ctx->render, NULL);
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->work, NULL);
+    pthread_cond_init(&ctx->finished, NULL);
+
+    //  Work with the threads that could be started
+    for (unsigned i = 0; i+1 < threads; i++) {
+        if (pthread_create(&ctx->threads[i], NULL, RenderThread, ctx)) break;
+        ctx->threadCount++;
+    }
+    return ctx;
+}
+
+renderctx* FreeRenderContext(renderctx* ctx) {
+    if (ctx == NULL) return NULL;
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->quit = 1;
+    pthread_cond_broadcast(&ctx->work);
+    pthread_mutex_unlock(&ctx->lock);
+    for (unsigned i = 0; i < ctx->threadCount; i++) pthread_join(ctx->threads[i], NULL);
+
+    pthread_cond_destroy(&ctx->finished);
+    pthread_cond_destroy(&ctx->work);
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_mutex_destroy(&ctx->render);
+
+    chunkalloc alloc = ctx->alloc;
+    if (ctx->buffer) alloc.free(ctx->buffer, alloc.user);
+    if (ctx->threads) alloc.free(ctx->threads, alloc.user);
+    alloc.free(ctx, alloc.user);
+    return NULL;
+}
+
+int RenderView(renderctx* ctx, unsigned width, unsigned height, double rl_low, double rl_high, double im_low, double im_high, unsigned* out) {
+    if (ctx == NULL || out == NULL || width == 0 || height == 0) return 1;
+
+    tileview view = {
+        .width = width,
+        .height = height,
+        .rl_low = rl_low,
+        .rl_high = rl_high,
+        .im_low = im_low,
+        .im_high = im_high,
+        .base = ctx->opts.base,
+        .max_iter = ctx->opts.max_iter,
+        .max_diff = ctx->opts.max_diff
+    };
+
+    pthread_mutex_lock(&ctx->render);
+    unsigned count = SplitTiles(&view, ctx->opts.tile, NULL);
+    tile* tiles = (tile*)ctx->alloc.alloc(sizeof(tile)*count, ctx->alloc.user);
+    if (!tiles) {
+        pthread_mutex_unlock(&ctx->render);
+        return 2;
+    }
+    SplitTiles(&view, ctx->opts.tile, tiles);
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->view = view;
+    ctx->tiles = tiles;
+    ctx->out = out;
+    ctx->next = ctx->done = 0;
+    ctx->failed = 0;
+    ctx->count = count;
+    pthread_cond_broadcast(&ctx->work);
+    TakeTiles(ctx, &ctx->buffer, &ctx->size);
+    while (ctx->done < ctx->count) pthread_cond_wait(&ctx->finished, &ctx->lock);
+    int failed = ctx->failed;
+    ctx->tiles = NULL;
+    ctx->out = NULL;
+    ctx->count = ctx->next = ctx->done = 0;
+    pthread_mutex_unlock(&ctx->lock);
+
+    ctx->alloc.free(tiles, ctx->alloc.user);
+    pthread_mutex_unlock(&ctx->render);
+    return failed ? 3 : 0;
+}
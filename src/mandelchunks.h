@@ -0,0 +1,48 @@
+#ifndef MANDELCHUNKS_H
+#define MANDELCHUNKS_H
+
+#include <stddef.h>
+
+//  Public interface of libmandelchunks. Every render context is independent, so any number
+//  of them can render at the same time. One context renders one view at a time.
+//  Only this interface is exported, the rest of the library is hidden.
+
+#if defined(__GNUC__)
+#define MANDELCHUNKS_API __attribute__((visibility("default")))
+#else
+#define MANDELCHUNKS_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct renderopts {
+    unsigned threads;   //  threads rendering a view including the one calling RenderView, 0 for one per processor
+    unsigned tile;      //  rows and columns of work given to a thread, rounded to multiple of base. Every tile is
+                        //  refined separately, so pixels near tile edges may change with tile
+    unsigned base, max_iter, max_diff;
+
+    //  Memory functions for everything the context allocates, malloc and free if NULL.
+    //  With more than one thread they are called from all of them at the same time, so they must be thread-safe
+    void* (*alloc)(size_t size, void* user);
+    void (*free)(void* ptr, void* user);
+    void* user;
+} renderopts;
+
+typedef struct renderctx renderctx;
+
+//  Fills opts with the defaults used by the interactive view
+extern MANDELCHUNKS_API void DefaultRenderOptions(renderopts* opts);
+//  Creates render context and its helper threads, opts NULL uses the defaults. Returns NULL on failure
+extern MANDELCHUNKS_API renderctx* CreateRenderContext(const renderopts* opts);
+//  Stops threads and frees context, returns NULL
+extern MANDELCHUNKS_API renderctx* FreeRenderContext(renderctx* ctx);
+//  Renders view and writes width*height iteration counts to out, row by row from top. Returns 0 on success
+extern MANDELCHUNKS_API int RenderView(renderctx* ctx, unsigned width, unsigned height, double rl_low, double rl_high, double im_low, double im_high, unsigned* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
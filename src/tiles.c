@@ -0,0 +1,186 @@
+#include "chunks.h"
+#include "tiles.h"
+#include "trace.h"
+
+//  Tile grown by a chunk and the pixel FlagDifferent reaches past it on every side, so chunks at tile edges are compared
+//  to their neighbors like in a single map
+static void TileApron(const tileview* view, const tile* t, tile* outer) {
+    unsigned apron = view->base + 1;
+    outer->x = t->x > apron ? t->x - apron : 0;
+    outer->y = t->y > apron ? t->y - apron : 0;
+    outer->w = (t->x+t->w+apron < view->width ? t->x+t->w+apron : view->width) - outer->x;
+    outer->h = (t->y+t->h+apron < view->height ? t->y+t->h+apron : view->height) - outer->y;
+}
+
+//  Refines tile with its apron until nothing is split, returns NULL on error
+static map* RefineTile(const tileview* view, const tile* t, const chunkalloc* alloc, tile* outer, int* passes) {
+    double rl_low, rl_high, im_low, im_high;
+    TileApron(view, t, outer);
+    TileBounds(view, outer, &rl_low, &rl_high, &im_low, &im_high);
+
+    map* ptr = InitMapAt(alloc, outer->w, outer->h, view->base, outer->x%view->base, outer->y%view->base, rl_low, rl_high, im_low, im_high);
+    if (!ptr) return NULL;
+
+    *passes = RefineMap(ptr, view->max_iter, view->max_diff, NULL);
+    if (*passes < 0) return FreeMap(ptr);
+    return ptr;
+}
+
+// -------------------------------------------------------------
+//  Functions declared in tiles.h
+unsigned SplitTiles(const tileview* view, unsigned size, tile* out) {
+    if (view->width == 0 || view->height == 0) return 0;
+
+    //  Tiles must start from multiple of base so chunks are the same as in a single map
+    if (size < view->base) size = view->base;
+    size -= size%view->base;
+
+    unsigned tilesX = view->width/size;
+    unsigned tilesY = view->height/size;
+    if (view->width%size > 0) tilesX++;
+    if (view->height%size > 0) tilesY++;
+
+    if (!out) return tilesX*tilesY;
+
+    unsigned count = 0;
+    for (unsigned row = 0; row < tilesY; row++) {
+        for (unsigned col = 0; col < tilesX; col++, count++) {
+            tile* t = &out[count];
+            t->x = col*size;
+            t->y = row*size;
+            //  Last column and row may be smaller
+            t->w = (t->x+size > view->width) ? view->width - t->x : size;
+            t->h = (t->y+size > view->height) ? view->height - t->y : size;
+        }
+    }
+    return count;
+}
+
+void TileBounds(const tileview* view, const tile* t, double* rl_low, double* rl_high, double* im_low, double* im_high) {
+    double rlstep = (view->rl_high - view->rl_low) /view->width;
+    double imstep = (view->im_high - view->im_low) /view->height;
+
+    *rl_low = view->rl_low + rlstep*t->x;
+    *rl_high = *rl_low + rlstep*t->w;
+    //  Imaginary axle grows upwards, so bottom of the tile is its low end
+    *im_low = view->im_low + imstep*(view->height - t->y - t->h);
+    *im_high = *im_low + imstep*t->h;
+}
+
+int RenderTile(const tileview* view, const tile* t, const chunkalloc* alloc, unsigned* out) {
+    TRACE_BEGIN(traceTile);
+    tile outer;
+    int passes;
+    map* ptr = RefineTile(view, t, alloc, &outer, &passes);
+    if (!ptr) return -1;
+
+    //  Only the tile is written, apron was rendered for its edges
+    for (unsigned row = 0; row < t->h; row++) {
+        chunk** src = ptr->chunks + (t->y - outer.y + row)*ptr->width + t->x - outer.x;
+        for (unsigned col = 0; col < t->w; col++) *out++ = src[col]->iterations;
+    }
+
+    FreeMap(ptr);
+    TRACE_END(traceTile, "Tile");
+    return passes;
+}
+
+int RenderTileRGB(const tileview* view, const tile* t, const chunkalloc* alloc, unsigned* out) {
+    if (view->aa > MAX_AA) return -1;
+    TRACE_BEGIN(traceTile);
+    tile outer;
+    int passes;
+    map* ptr = RefineTile(view, t, alloc, &outer, &passes);
+    if (!ptr) return -1;
+
+    //  Chunks still flagged are edges which could not be split anymore
+    unsigned* samples = NULL;
+    if (view->aa > 1) {
+        samples = (unsigned*)ptr->alloc.alloc(sizeof(unsigned)*view->aa*view->aa, ptr->alloc.user);
+        if (!samples) {
+            FreeMap(ptr);
+            return -1;
+        }
+    }
+
+    TRACE_BEGIN(traceShade);
+    for (unsigned row = 0; row < t->h; row++) {
+        chunk** src = ptr->chunks + (t->y - outer.y + row)*ptr->width + t->x - outer.x;
+        for (unsigned col = 0; col < t->w; col++) {
+            unsigned rgb[3];
+            ShadeChunk(ptr, src[col], view->max_iter, view->aa, samples, rgb);
+            *out++ = rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+        }
+    }
+    TRACE_END(traceShade, "Shade");
+
+    if (samples) ptr->alloc.free(samples, ptr->alloc.user);
+    FreeMap(ptr);
+    TRACE_END(traceTile, "Tile");
+    return passes;
+}
+
+int RefineMap(map* ptr, unsigned max_iter, unsigned max_diff, unsigned long long* evaluations) {
+    //  Same passes as the interactive view does, until nothing is split
+    int passes = 0;
+    int recalc = 1;
+    while (recalc) {
+        //  Nothing is flagged before the first pass, so it always continues
+        TRACE_BEGIN(traceSplit);
+        int split = SplitChunks(ptr);
+        TRACE_END(traceSplit, "Split");
+        if (split < 0) return -1;
+        recalc = split || passes == 0;
+
+        TRACE_BEGIN(traceMandel);
+        unsigned iterated = IterateChunks(ptr, max_iter);
+        TRACE_END(traceMandel, "Mandel");
+        if (evaluations) *evaluations += iterated;
+
+        TRACE_BEGIN(traceDiff);
+        FlagDifferent(ptr, max_diff);
+        TRACE_END(traceDiff, "Diff");
+        passes++;
+    }
+    return passes;
+}
+
+void StitchTile(const tileview* view, const tile* t, const unsigned* src, unsigned* dst) {
+    dst += t->y*view->width + t->x;
+    for (unsigned row = 0; row < t->h; row++, src += t->w, dst += view->width) {
+        for (unsigned col = 0; col < t->w; col++) dst[col] = src[col];
+    }
+}
+
+void ColorIteration(unsigned iter, unsigned max_iter, unsigned rgb[3]) {
+    double colStep = (double)255/max_iter;
+    rgb[0] = rgb[1] = rgb[2] = 0;
+    if (iter>= max_iter) {
+        return;
+    } else if (iter < max_iter/2) {
+        rgb[0] = (double)iter * colStep * 2;
+    } else {
+        int c = (double)iter * colStep;
+        rgb[0] = 0xff;
+        rgb[1] = c;
+        rgb[2] = c;
+    }
+}
+
+void ShadeChunk(map* ptr, chunk* chn, unsigned max_iter, unsigned aa, unsigned* samples, unsigned rgb[3]) {
+    if (aa <= 1 || !(chn->flags & CHUNK_DIFF)) {
+        ColorIteration(chn->iterations, max_iter, rgb);
+        return;
+    }
+
+    //  Average colors of the samples, not iterations
+    unsigned sum[3] = {0};
+    SupersampleChunk(ptr, chn, max_iter, aa, samples);
+    for (unsigned s = 0; s < aa*aa; s++) {
+        ColorIteration(samples[s], max_iter, rgb);
+        sum[0] += rgb[0];
+        sum[1] += rgb[1];
+        sum[2] += rgb[2];
+    }
+    for (unsigned c = 0; c < 3; c++) rgb[c] = sum[c]/(aa*aa);
+}
@@ -0,0 +1,38 @@
+struct chunkalloc;
+struct chunk;
+struct map;
+
+//  Rectangular part of the whole image in pixels
+typedef struct tile {
+    unsigned x,y, w,h;
+} tile;
+
+//  Largest anti-aliasing grid, keeps aa*aa samples small
+#define MAX_AA 16
+
+//  Everything needed to render any tile of an image
+typedef struct tileview {
+    unsigned width, height; //  size of the whole image
+    double rl_low, rl_high, im_low, im_high;
+    unsigned base, max_iter, max_diff;
+    unsigned aa;            //  edges are supersampled aa*aa times if aa > 1, only for colors
+} tileview;
+
+//  Splits view to tiles, tile size is rounded to multiple of base. Tiles are written to out if not NULL, returns count of tiles
+extern unsigned SplitTiles(const tileview* view, unsigned size, tile* out);
+//  Calculates the area of complex plane covered by tile
+extern void TileBounds(const tileview* view, const tile* t, double* rl_low, double* rl_high, double* im_low, double* im_high);
+//  Renders tile with chunks until nothing is split, writes w*h iteration counts to out.
+//  Chunks are allocated with alloc or malloc if NULL. Returns passes or -1 on error
+extern int RenderTile(const tileview* view, const tile* t, const struct chunkalloc* alloc, unsigned* out);
+//  Same as RenderTile, but writes colors packed as 0xRRGGBB. Returns -1 also if aa > MAX_AA
+extern int RenderTileRGB(const tileview* view, const tile* t, const struct chunkalloc* alloc, unsigned* out);
+//  Refines map until nothing is split, the passes every render uses. Chunks iterated are added to evaluations if not NULL.
+//  Returns passes or -1 if allocation fails
+extern int RefineMap(struct map* ptr, unsigned max_iter, unsigned max_diff, unsigned long long* evaluations);
+//  Copies pixels of rendered tile to the image of whole view
+extern void StitchTile(const tileview* view, const tile* t, const unsigned* src, unsigned* dst);
+//  Color of iteration count, each component 0-255
+extern void ColorIteration(unsigned iter, unsigned max_iter, unsigned rgb[3]);
+//  Color of chunk. If aa > 1 and chunk is flagged different, colors of aa*aa samples are averaged, samples must fit them
+extern void ShadeChunk(struct map* ptr, struct chunk* chn, unsigned max_iter, unsigned aa, unsigned* samples, unsigned rgb[3]);
@@ -0,0 +1,225 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+
+#define TRACE_MAX_NAMES  16
+#define TRACE_MAX_EVENTS (1 << 20)  //  Limits memory used by long sessions
+
+typedef struct traceevent {
+    const char* name;
+    unsigned long long begin, dur;
+    unsigned tid;
+} traceevent;
+
+//  Section times and counters of one pass
+typedef struct tracepass {
+    unsigned long long end;
+    unsigned long long time[TRACE_MAX_NAMES];
+    unsigned long long counter[TRACE_COUNTERS];
+} tracepass;
+
+static const char* counterNames[TRACE_COUNTERS] = {
+    "chunks_created", "chunks_iterated", "iterations", "early_outs", "bytes_allocated"
+};
+
+int traceEnabled = 0;
+_Thread_local int traceMuted = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long counters[TRACE_COUNTERS];
+static unsigned long long counted[TRACE_COUNTERS];  //  Counter totals at the end of last pass
+
+static const char* names[TRACE_MAX_NAMES];
+static unsigned nameCount = 0;
+
+static traceevent* events = NULL;
+static unsigned eventCount = 0, eventSize = 0;
+
+static tracepass current;
+static tracepass* passes = NULL;
+static unsigned passCount = 0, passSize = 0;
+
+static unsigned nextThread = 0;
+static _Thread_local unsigned threadId = 0;
+
+//  Index of section name, adds new names. Must be called with lock held
+static int NameIndex(const char* name) {
+    for (unsigned i = 0; i < nameCount; i++) {
+        if (names[i] == name || !strcmp(names[i], name)) return i;
+    }
+    if (nameCount >= TRACE_MAX_NAMES) return -1;
+    names[nameCount] = name;
+    return nameCount++;
+}
+
+// -------------------------------------------------------------
+//  Functions declared in trace.h
+void TraceEnable(int on) {
+    __atomic_store_n(&traceEnabled, on, __ATOMIC_RELAXED);
+}
+
+void TraceMute(int on) {
+    traceMuted = on;
+}
+
+void TraceReset(void) {
+    pthread_mutex_lock(&lock);
+    free(events);
+    events = NULL;
+    eventCount = eventSize = 0;
+    free(passes);
+    passes = NULL;
+    passCount = passSize = 0;
+    memset(&current, 0, sizeof(current));
+    for (unsigned i = 0; i < TRACE_COUNTERS; i++) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+        counted[i] = 0;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+unsigned long long TraceNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+void TraceEvent(const char* name, unsigned long long begin) {
+    unsigned long long dur = TraceNow() - begin;
+    if (threadId == 0) threadId = __atomic_add_fetch(&nextThread, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&lock);
+    int index = NameIndex(name);
+    if (index >= 0) current.time[index] += dur;
+
+    if (eventCount >= eventSize && eventSize < TRACE_MAX_EVENTS) {
+        unsigned size = eventSize ? eventSize*2 : 1024;
+        traceevent* tmp = (traceevent*)realloc(events, sizeof(traceevent)*size);
+        if (tmp) {
+            events = tmp;
+            eventSize = size;
+        }
+    }
+    if (eventCount < eventSize) {
+        traceevent* ev = &events[eventCount++];
+        ev->name = name;
+        ev->begin = begin;
+        ev->dur = dur;
+        ev->tid = threadId;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void TraceCount(unsigned counter, unsigned long long amount) {
+    __atomic_add_fetch(&counters[counter], amount, __ATOMIC_RELAXED);
+}
+
+void TraceEndPass(void) {
+    if (!TRACE_ENABLED()) return;
+    pthread_mutex_lock(&lock);
+    if (passCount >= passSize) {
+        unsigned size = passSize ? passSize*2 : 64;
+        tracepass* tmp = (tracepass*)realloc(passes, sizeof(tracepass)*size);
+        if (tmp) {
+            passes = tmp;
+            passSize = size;
+        }
+    }
+    if (passCount < passSize) {
+        //  Counters are totals, pass stores the change since previous pass
+        current.end = TraceNow();
+        for (unsigned i = 0; i < TRACE_COUNTERS; i++) {
+            unsigned long long total = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+            current.counter[i] = total - counted[i];
+            counted[i] = total;
+        }
+        passes[passCount++] = current;
+    }
+    memset(&current, 0, sizeof(current));
+    pthread_mutex_unlock(&lock);
+}
+
+unsigned TracePasses(void) {
+    pthread_mutex_lock(&lock);
+    unsigned count = passCount;
+    pthread_mutex_unlock(&lock);
+    return count;
+}
+
+void TracePrintSummary(unsigned first) {
+    pthread_mutex_lock(&lock);
+    if (first >= passCount) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    unsigned count = passCount - first;
+    printf("%u passes traced\n", count);
+
+    unsigned long long total = 0;
+    for (unsigned n = 0; n < nameCount; n++) {
+        unsigned long long sum = 0;
+        for (unsigned p = first; p < passCount; p++) sum += passes[p].time[n];
+        total += sum;
+        printf("%s\t%llu us (%g)\n", names[n], sum, (double)sum/count);
+    }
+    printf("Total\t%llu us (%g)\n", total, (double)total/count);
+
+    for (unsigned i = 0; i < TRACE_COUNTERS; i++) {
+        unsigned long long sum = 0;
+        for (unsigned p = first; p < passCount; p++) sum += passes[p].counter[i];
+        printf("%s\t%llu\n", counterNames[i], sum);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+int TraceWriteJSON(const char* name) {
+    FILE* file = fopen(name, "w");
+    if (!file) return 1;
+
+    pthread_mutex_lock(&lock);
+    int pid = getpid();
+    fprintf(file, "{\"traceEvents\":[\n");
+    for (unsigned i = 0; i < eventCount; i++) {
+        traceevent* ev = &events[i];
+        fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%u}",
+            i ? ",\n" : "", ev->name, ev->begin, ev->dur, pid, ev->tid);
+    }
+    //  Counters are shown as graphs, one sample at the end of every pass
+    for (unsigned p = 0; p < passCount; p++) {
+        fprintf(file, "%s{\"name\":\"counters\",\"ph\":\"C\",\"ts\":%llu,\"pid\":%d,\"args\":{",
+            (eventCount || p) ? ",\n" : "", passes[p].end, pid);
+        for (unsigned i = 0; i < TRACE_COUNTERS; i++) {
+            fprintf(file, "%s\"%s\":%llu", i ? "," : "", counterNames[i], passes[p].counter[i]);
+        }
+        fprintf(file, "}}");
+    }
+    fprintf(file, "\n]}\n");
+    pthread_mutex_unlock(&lock);
+
+    return fclose(file) ? 1 : 0;
+}
+
+int TraceWriteCSV(const char* name) {
+    FILE* file = fopen(name, "w");
+    if (!file) return 1;
+
+    pthread_mutex_lock(&lock);
+    fprintf(file, "pass");
+    for (unsigned n = 0; n < nameCount; n++) fprintf(file, ",%s_us", names[n]);
+    for (unsigned i = 0; i < TRACE_COUNTERS; i++) fprintf(file, ",%s", counterNames[i]);
+    fprintf(file, "\n");
+
+    for (unsigned p = 0; p < passCount; p++) {
+        fprintf(file, "%u", p+1);
+        for (unsigned n = 0; n < nameCount; n++) fprintf(file, ",%llu", passes[p].time[n]);
+        for (unsigned i = 0; i < TRACE_COUNTERS; i++) fprintf(file, ",%llu", passes[p].counter[i]);
+        fprintf(file, "\n");
+    }
+    pthread_mutex_unlock(&lock);
+
+    return fclose(file) ? 1 : 0;
+}
@@ -0,0 +1,44 @@
+//  Counters collected while tracing is enabled
+enum {
+    TRACE_CHUNKS_CREATED,
+    TRACE_CHUNKS_ITERATED,
+    TRACE_ITERATIONS,
+    TRACE_EARLY_OUTS,       //  iterations stopped because orbit got stuck
+    TRACE_BYTES_ALLOCATED,
+    TRACE_COUNTERS
+};
+
+//  Non-zero while tracing, read with TRACE_ENABLED as other threads may change it. Use the macros below instead of
+//  calling functions directly
+extern int traceEnabled;
+//  Non-zero in a thread whose work is not traced, set with TraceMute
+extern _Thread_local int traceMuted;
+#define TRACE_ENABLED() (__atomic_load_n(&traceEnabled, __ATOMIC_RELAXED) && !traceMuted)
+
+//  Times a section, name must be a string literal or otherwise live until trace is written
+#define TRACE_BEGIN(var) unsigned long long var = TRACE_ENABLED() ? TraceNow() : 0
+#define TRACE_END(var, name) do { if (var) TraceEvent(name, var); } while (0)
+#define TRACE_COUNT(counter, amount) do { if (TRACE_ENABLED()) TraceCount(counter, amount); } while (0)
+
+//  Turns tracing on or off, recorded data is kept until TraceReset
+extern void TraceEnable(int on);
+//  Turns tracing off or back on for the calling thread only, for work which is not part of the traced passes
+extern void TraceMute(int on);
+//  Frees recorded events and passes and zeroes counters, pass numbers start again from 0
+extern void TraceReset(void);
+//  Monotonic time in microseconds
+extern unsigned long long TraceNow(void);
+//  Records section which started at begin and ends now
+extern void TraceEvent(const char* name, unsigned long long begin);
+//  Adds amount to counter
+extern void TraceCount(unsigned counter, unsigned long long amount);
+//  Closes current pass, its section times and counters become a row of the CSV
+extern void TraceEndPass(void);
+//  Returns number of passes recorded
+extern unsigned TracePasses(void);
+//  Prints totals of passes from first to the last one
+extern void TracePrintSummary(unsigned first);
+//  Writes recorded events as Chrome trace-event JSON, returns 0 on success
+extern int TraceWriteJSON(const char* name);
+//  Writes one row per pass as CSV, returns 0 on success
+extern int TraceWriteCSV(const char* name);
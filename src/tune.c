@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "chunks.h"
+#include "tiles.h"
+#include "tune.h"
+
+//  Renders view until nothing is split and compares it to truth. Returns non-zero if allocation fails
+static int TuneOne(const tileview* view, const unsigned* truth, tuneresult* res) {
+    res->evaluations = 0;
+    res->wrong = 0;
+    res->error = 0;
+
+    map* ptr = InitMap(view->width, view->height, res->base, view->rl_low, view->rl_high, view->im_low, view->im_high);
+    if (!ptr) return 1;
+    if (RefineMap(ptr, view->max_iter, res->max_diff, &res->evaluations) < 0) {
+        FreeMap(ptr);
+        return 1;
+    }
+
+    unsigned length = view->width*view->height;
+    unsigned long long sum = 0;
+    for (unsigned i = 0; i < length; i++) {
+        int diff = ptr->chunks[i]->iterations - truth[i];
+        if (diff < 0) diff = -diff; // absolute value
+        if (diff > 0) res->wrong++;
+        sum += diff;
+    }
+    res->error = (double)sum/length;
+    FreeMap(ptr);
+    return 0;
+}
+
+// -------------------------------------------------------------
+//  Functions declared in tune.h
+unsigned TuneView(const tileview* view, const unsigned* bases, unsigned nbases, const unsigned* diffs, unsigned ndiffs, double prune, tuneresult** out) {
+    *out = NULL;
+    unsigned length = view->width*view->height;
+    unsigned* truth = (unsigned*)malloc(sizeof(unsigned)*length);
+    tuneresult* ret = (tuneresult*)malloc(sizeof(tuneresult)*nbases*ndiffs);
+    if (!truth || !ret || length == 0) {
+        free(truth);
+        free(ret);
+        return 0;
+    }
+
+    //  Brute force, chunks of one pixel sample the same points as fully split chunks
+    map* ptr = InitMap(view->width, view->height, 1, view->rl_low, view->rl_high, view->im_low, view->im_high);
+    if (!ptr) {
+        free(truth);
+        free(ret);
+        return 0;
+    }
+    IterateChunks(ptr, view->max_iter);
+    for (unsigned i = 0; i < length; i++) truth[i] = ptr->chunks[i]->iterations;
+    FreeMap(ptr);
+
+    unsigned count = 0;
+    for (unsigned b = 0; b < nbases; b++) {
+        for (unsigned d = 0; d < ndiffs; d++) {
+            ret[count].base = bases[b];
+            ret[count].max_diff = diffs[d];
+            if (TuneOne(view, truth, &ret[count])) {
+                free(truth);
+                free(ret);
+                return 0;
+            }
+            count++;
+            //  Larger differences flag fewer chunks, so they are rarely less wrong
+            if (prune > 0 && ret[count-1].wrong > prune*length) break;
+        }
+    }
+    free(truth);
+    *out = ret;
+    return count;
+}
+
+int TuneRecommend(const tuneresult* results, unsigned count, unsigned pixels, double tolerance) {
+    int best = -1;
+    for (unsigned i = 0; i < count; i++) {
+        if (results[i].wrong > tolerance*pixels) continue;
+        //  Of equally cheap settings prefer the more accurate one
+        if (best < 0 || results[i].evaluations < results[best].evaluations
+            || (results[i].evaluations == results[best].evaluations && results[i].error < results[best].error)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+void TunePrint(const tuneresult* results, unsigned count, unsigned w, unsigned h) {
+    unsigned length = w*h;
+    printf("base\tdiff\tevaluations\tsaved\twrong\terror\n");
+    for (unsigned i = 0; i < count; i++) {
+        const tuneresult* res = &results[i];
+        printf("%u\t%u\t%llu\t\t%.1f%%\t%.3f%%\t%.4f\n", res->base, res->max_diff, res->evaluations,
+            100.0 - 100.0*res->evaluations/length, 100.0*res->wrong/length, res->error);
+    }
+}
@@ -0,0 +1,16 @@
+//  Result of rendering a view with one setting
+typedef struct tuneresult {
+    unsigned base, max_diff;
+    unsigned long long evaluations; //  chunks iterated in all passes
+    unsigned wrong;                 //  pixels differing from brute force
+    double error;                   //  mean absolute difference of iterations per pixel
+} tuneresult;
+
+//  Renders view brute force and with every combination of bases and diffs, base and max_diff of view are ignored.
+//  Diffs must be ascending. If prune > 0, larger diffs of a base are skipped once more than prune fraction of pixels is wrong.
+//  Results are allocated to *out, returns number of results
+extern unsigned TuneView(const tileview* view, const unsigned* bases, unsigned nbases, const unsigned* diffs, unsigned ndiffs, double prune, tuneresult** out);
+//  Returns index of result with least evaluations having at most tolerance fraction of pixels wrong, -1 if none
+extern int TuneRecommend(const tuneresult* results, unsigned count, unsigned pixels, double tolerance);
+//  Prints results as a table compared to brute force of w*h evaluations
+extern void TunePrint(const tuneresult* results, unsigned count, unsigned w, unsigned h);